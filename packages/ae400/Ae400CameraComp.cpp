@@ -14,10 +14,16 @@ Modify this driver to support LIPS AE400 Stereo Camera
 */
 #include "Ae400CameraComp.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
 #include <memory>
+#include <optional>
 #include <string>
 #include <utility>
+#include <vector>
 
+#include "engine/core/constants.hpp"
 #include "engine/gems/geometry/pinhole.hpp"
 #include "engine/gems/image/conversions.hpp"
 #include "engine/gems/image/utils.hpp"
@@ -33,6 +39,20 @@ namespace lips {
 const int kLeftIrStreamId = 1;
 const int kRightIrStreamId = 2;
 const int64_t kIrMaxDeltaTs = SecondsToNano(1.);
+// Z16 depth units in meters
+const float kDepthUnit = 0.001f;
+// Obstacle grid cell values
+const uint8_t kGridFree = 0;
+const uint8_t kGridUnknown = 128;
+const uint8_t kGridOccupied = 255;
+// Beam index of band columns whose ray is too steep to have a meaningful azimuth
+const uint16_t kNoBeam = 0xFFFF;
+// Minimum horizontal component of a normalized pixel ray to assign it to a beam. Rays steeper
+// than about 75 degrees are ignored.
+const float kMinHorizontalRay = 0.25f;
+// Number of image rows reduced per column before the columns are mapped to beams. It bounds the
+// bearing error caused by the azimuth changing along a column of a tilted camera.
+const int kBeamBandRows = 16;
 
 // Check the current firmware version vs. the recommended firmware version and
 // log a warning if they do not match
@@ -162,6 +182,25 @@ struct AE400Camera::Impl {
   rs2::spatial_filter spat_filter;    // Spatial  - edge-preserving spatial smoothing
   rs2::temporal_filter temp_filter;   // Temporal - reduces temporal noise
   rs2::disparity_transform disparity_to_depth = rs2::disparity_transform(false);
+  // Ray tables used to reduce the depth image to the flatscan and obstacle grid. A depth pixel
+  // (row, col) with depth d is located at d * (column_ray[col] + row_ray[row]) + camera position
+  // in the robot frame. The tables are rebuilt if the depth intrinsics or mount pose change.
+  bool ray_tables_valid = false;
+  bool mount_pose_warned = false;          // warn only once about a missing mount pose
+  bool depth_scan_published = false;       // robot_T_depth_scan was published at least once
+  geometry::PinholeD ray_tables_pinhole;   // depth intrinsics used to build the tables
+  Pose3d ray_tables_pose;                  // robot_T_depth_camera used to build the tables
+  Eigen::ArrayXf column_ray_x, column_ray_y, column_ray_z;  // per-column ray in robot frame
+  std::vector<Vector3f> row_rays;          // per-row ray offset in robot frame
+  std::vector<uint16_t> beam_index;        // flatscan beam of each band column, or kNoBeam
+  Eigen::ArrayXf beam_angles;              // flatscan beam angles in the robot frame
+  // Scratch buffers for the row reduction, one entry per depth image column
+  Eigen::ArrayXf row_depth, row_height, row_range_sq;
+  // Per column of the current band of rows, and per beam: squared horizontal range of the
+  // closest obstacle (infinity if none), and of the farthest point on the floor or in the height
+  // band (0 if none)
+  Eigen::ArrayXf band_hit_sq, band_observed_sq;
+  Eigen::ArrayXf beam_hit_sq, beam_observed_sq;
 };
 
 // The function returns the rs2::video_frame timestamp in nanoseconds adjusted to the difference
@@ -182,6 +221,10 @@ int64_t AE400Camera::getAdjustedTimeStamp(int64_t camera_timestamp, TimeStampInf
 }
 
 void AE400Camera::start() {
+  if (!checkObstacleParameters()) {
+    return;
+  }
+
   try {
     impl_ = std::make_unique<Impl>();
 
@@ -250,7 +293,10 @@ void AE400Camera::start() {
       cfg.enable_stream(RS2_STREAM_INFRARED, kRightIrStreamId, get_cols(), get_rows(),
                         RS2_FORMAT_Y8, get_ir_framerate());
     }
-    if (get_enable_depth()) {
+    // The flatscan and obstacle grid are computed from the depth stream, so it is acquired for
+    // them even if the dense depth image is not enabled.
+    const bool obstacles_on = get_enable_flatscan() || get_enable_obstacle_grid();
+    if (get_enable_depth() || obstacles_on) {
       impl_->active_streams |= StreamType::kDepth;
       cfg.enable_stream(RS2_STREAM_DEPTH, get_cols(), get_rows(), RS2_FORMAT_Z16,
                         get_depth_framerate());
@@ -385,17 +431,24 @@ void AE400Camera::tick() {
         depth_frame.swap(filtered);
       }
 
-      CpuBufferConstView depth_buffer(reinterpret_cast<const byte*>(depth_frame.get_data()),
-                                      depth_frame.get_height() * depth_frame.get_stride_in_bytes());
-      ImageConstView1ui16 depth_image_view(depth_buffer, depth_frame.get_height(),
-                                          depth_frame.get_width());
-      Image1f depth_image(depth_image_view.dimensions());
-      ConvertUi16ToF32(depth_image_view, depth_image, 0.001);
-
-      ToProto(ToPinhole(depth_frame), tx_depth_intrinsics().initProto().initPinhole());
-      ToProto(std::move(depth_image), tx_depth().initProto(), tx_depth().buffers());
-      tx_depth().publish(acqtime);
-      tx_depth_intrinsics().publish(acqtime);
+      if (get_enable_depth()) {
+        CpuBufferConstView depth_buffer(
+            reinterpret_cast<const byte*>(depth_frame.get_data()),
+            depth_frame.get_height() * depth_frame.get_stride_in_bytes());
+        ImageConstView1ui16 depth_image_view(depth_buffer, depth_frame.get_height(),
+                                            depth_frame.get_width());
+        Image1f depth_image(depth_image_view.dimensions());
+        ConvertUi16ToF32(depth_image_view, depth_image, kDepthUnit);
+
+        ToProto(ToPinhole(depth_frame), tx_depth_intrinsics().initProto().initPinhole());
+        ToProto(std::move(depth_image), tx_depth().initProto(), tx_depth().buffers());
+        tx_depth().publish(acqtime);
+        tx_depth_intrinsics().publish(acqtime);
+      }
+
+      if (get_enable_flatscan() || get_enable_obstacle_grid()) {
+        publishObstacles(depth_frame, acqtime);
+      }
     }
 
     if (color_on) {
@@ -461,6 +514,280 @@ void AE400Camera::stop() {
   }
 }
 
+// Checks the flatscan and obstacle grid parameters before any device is accessed
+bool AE400Camera::checkObstacleParameters() {
+  if (!get_enable_flatscan() && !get_enable_obstacle_grid()) {
+    return true;
+  }
+  if (get_obstacle_min_height() >= get_obstacle_max_height()) {
+    reportFailure("obstacle_min_height (%f) must be smaller than obstacle_max_height (%f)",
+                  get_obstacle_min_height(), get_obstacle_max_height());
+    return false;
+  }
+  if (get_flatscan_max_range() <= 0.0 || get_flatscan_min_range() >= get_flatscan_max_range()) {
+    reportFailure("Invalid flatscan range [%f, %f]", get_flatscan_min_range(),
+                  get_flatscan_max_range());
+    return false;
+  }
+  if (get_enable_obstacle_grid() &&
+      (get_obstacle_grid_rows() <= 0 || get_obstacle_grid_cols() <= 0 ||
+       get_obstacle_grid_cell_size() <= 0.0)) {
+    reportFailure("Invalid obstacle grid size %d x %d with cell size %f",
+                  get_obstacle_grid_rows(), get_obstacle_grid_cols(),
+                  get_obstacle_grid_cell_size());
+    return false;
+  }
+  return true;
+}
+
+// Builds the ray tables for the flatscan and obstacle grid. The ray of a depth pixel in the robot
+// frame is R * ((col - cx) / fx, (row - cy) / fy, 1), which splits into a per-column term
+// ((col - cx) / fx) * R.col(0) + R.col(2) and a per-row term ((row - cy) / fy) * R.col(1).
+// R is the rotation of robot_T_depth_camera, the depth_camera frame being the optical frame.
+void AE400Camera::updateRayTables(const geometry::PinholeD& pinhole,
+                                  const Pose3d& robot_T_depth_camera) {
+  const int rows = pinhole.dimensions[0];
+  const int cols = pinhole.dimensions[1];
+  const Matrix3f rotation = robot_T_depth_camera.rotation.matrix().cast<float>();
+
+  impl_->column_ray_x.resize(cols);
+  impl_->column_ray_y.resize(cols);
+  impl_->column_ray_z.resize(cols);
+  for (int col = 0; col < cols; col++) {
+    const float u = static_cast<float>((col - pinhole.center[1]) / pinhole.focal[1]);
+    const Vector3f ray = u * rotation.col(0) + rotation.col(2);
+    impl_->column_ray_x[col] = ray.x();
+    impl_->column_ray_y[col] = ray.y();
+    impl_->column_ray_z[col] = ray.z();
+  }
+
+  impl_->row_rays.resize(rows);
+  for (int row = 0; row < rows; row++) {
+    const float v = static_cast<float>((row - pinhole.center[0]) / pinhole.focal[0]);
+    impl_->row_rays[row] = v * rotation.col(1);
+  }
+
+  // The azimuth of a pixel does not depend on its depth. For a tilted camera it changes along an
+  // image column, so every column of a band of kBeamBandRows rows is assigned to the beam of its
+  // center pixel. Azimuths are relative to the camera heading to avoid wrapping around +/-pi.
+  Vector2f heading = rotation.col(2).head<2>();
+  if (heading.norm() < kMinHorizontalRay) {
+    // The camera looks straight down, use the image up direction instead
+    heading = -rotation.col(1).head<2>();
+  }
+  const float heading_angle = std::atan2(heading.y(), heading.x());
+  const int num_bands = (rows + kBeamBandRows - 1) / kBeamBandRows;
+  std::vector<float> azimuths(num_bands * cols);
+  float min_azimuth = std::numeric_limits<float>::infinity();
+  float max_azimuth = -std::numeric_limits<float>::infinity();
+  for (int band = 0; band < num_bands; band++) {
+    const Vector3f& row_ray = impl_->row_rays[std::min(band * kBeamBandRows + kBeamBandRows / 2,
+                                                       rows - 1)];
+    for (int col = 0; col < cols; col++) {
+      const Vector3f ray(impl_->column_ray_x[col] + row_ray.x(),
+                         impl_->column_ray_y[col] + row_ray.y(),
+                         impl_->column_ray_z[col] + row_ray.z());
+      float& azimuth = azimuths[band * cols + col];
+      // Steep rays are ignored, their azimuth jumps around close to the nadir
+      if (ray.head<2>().norm() < kMinHorizontalRay * ray.norm()) {
+        azimuth = std::numeric_limits<float>::quiet_NaN();
+        continue;
+      }
+      azimuth = std::remainder(std::atan2(ray.y(), ray.x()) - heading_angle, 2.0f * Pi<float>);
+      min_azimuth = std::min(min_azimuth, azimuth);
+      max_azimuth = std::max(max_azimuth, azimuth);
+    }
+  }
+
+  // Split the field of view into as many beams of equal angular width as image columns
+  const int num_beams = cols;
+  const float beam_width =
+      std::max((max_azimuth - min_azimuth) / num_beams, std::numeric_limits<float>::epsilon());
+  impl_->beam_index.resize(num_bands * cols);
+  for (size_t i = 0; i < azimuths.size(); i++) {
+    impl_->beam_index[i] = std::isnan(azimuths[i])
+        ? kNoBeam
+        : static_cast<uint16_t>(std::min(
+              num_beams - 1, static_cast<int>((azimuths[i] - min_azimuth) / beam_width)));
+  }
+  impl_->beam_angles.resize(num_beams);
+  for (int beam = 0; beam < num_beams; beam++) {
+    impl_->beam_angles[beam] = heading_angle + min_azimuth + (beam + 0.5f) * beam_width;
+  }
+
+  impl_->row_depth.resize(cols);
+  impl_->row_height.resize(cols);
+  impl_->row_range_sq.resize(cols);
+  impl_->band_hit_sq.resize(cols);
+  impl_->band_observed_sq.resize(cols);
+  impl_->beam_hit_sq.resize(num_beams);
+  impl_->beam_observed_sq.resize(num_beams);
+
+  // The flatscan originates at the camera position projected onto the ground plane. It is first
+  // published at time 0 so that it is available for every scan, later mount changes are published
+  // at the current tick time.
+  Pose3d robot_T_depth_scan = Pose3d::Identity();
+  robot_T_depth_scan.translation = Vector3d(robot_T_depth_camera.translation.x(),
+                                            robot_T_depth_camera.translation.y(), 0.0);
+  set_robot_T_depth_scan(robot_T_depth_scan, impl_->depth_scan_published ? getTickTime() : 0.0);
+  impl_->depth_scan_published = true;
+
+  impl_->ray_tables_pinhole = pinhole;
+  impl_->ray_tables_pose = robot_T_depth_camera;
+  impl_->ray_tables_valid = true;
+}
+
+// Reduces the depth image to the closest obstacle per beam within the configured height band,
+// and publishes it as a flatscan and/or an obstacle grid
+void AE400Camera::publishObstacles(const rs2::depth_frame& depth_frame, int64_t acqtime) {
+  const std::optional<Pose3d> maybe_robot_T_depth_camera =
+      try_get_robot_T_depth_camera(getTickTime());
+  if (!maybe_robot_T_depth_camera) {
+    if (!impl_->mount_pose_warned) {
+      LOG_WARNING("robot_T_depth_camera is not available, flatscan and obstacle grid are skipped");
+      impl_->mount_pose_warned = true;
+    }
+    return;
+  }
+  const Pose3d& robot_T_depth_camera = *maybe_robot_T_depth_camera;
+
+  // Rebuild the ray tables if the depth intrinsics or the camera mount changed
+  const geometry::PinholeD pinhole = ToPinhole(depth_frame);
+  if (!impl_->ray_tables_valid || pinhole.dimensions != impl_->ray_tables_pinhole.dimensions ||
+      pinhole.focal != impl_->ray_tables_pinhole.focal ||
+      pinhole.center != impl_->ray_tables_pinhole.center ||
+      robot_T_depth_camera.translation != impl_->ray_tables_pose.translation ||
+      robot_T_depth_camera.rotation.matrix() != impl_->ray_tables_pose.rotation.matrix()) {
+    updateRayTables(pinhole, robot_T_depth_camera);
+  }
+
+  const int rows = pinhole.dimensions[0];
+  const int cols = pinhole.dimensions[1];
+  const int num_beams = impl_->beam_angles.size();
+  const float infinity = std::numeric_limits<float>::infinity();
+  const float camera_height = static_cast<float>(robot_T_depth_camera.translation.z());
+  const float min_height = static_cast<float>(get_obstacle_min_height());
+  const float max_height = static_cast<float>(get_obstacle_max_height());
+  const float min_range = static_cast<float>(get_flatscan_min_range());
+  const float max_range = static_cast<float>(get_flatscan_max_range());
+
+  // Column-min reduction over the image rows. Each row is processed as a whole with Eigen array
+  // expressions so that the per-pixel work is vectorized across columns. The per-column results
+  // of every band of kBeamBandRows rows are then folded into the beams.
+  Impl& impl = *impl_;
+  impl.beam_hit_sq.setConstant(infinity);
+  impl.beam_observed_sq.setZero();
+  impl.band_hit_sq.setConstant(infinity);
+  impl.band_observed_sq.setZero();
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(depth_frame.get_data());
+  const int stride = depth_frame.get_stride_in_bytes();
+  for (int row = 0; row < rows; row++) {
+    const Eigen::Map<const Eigen::Array<uint16_t, Eigen::Dynamic, 1>> raw_depth(
+        reinterpret_cast<const uint16_t*>(data + row * stride), cols);
+    const Vector3f& row_ray = impl.row_rays[row];
+    impl.row_depth = raw_depth.cast<float>() * kDepthUnit;
+    impl.row_height = impl.row_depth * (impl.column_ray_z + row_ray.z()) + camera_height;
+    impl.row_range_sq = (impl.row_depth * (impl.column_ray_x + row_ray.x())).square() +
+                        (impl.row_depth * (impl.column_ray_y + row_ray.y())).square();
+    // A raw depth of 0 marks a pixel without depth data. Obstacles closer than flatscan_min_range
+    // are kept, they are reported as invalid ranges instead of being dropped.
+    impl.band_hit_sq = (impl.row_depth > 0.0f && impl.row_height >= min_height &&
+                        impl.row_height <= max_height)
+                           .select(impl.row_range_sq.min(impl.band_hit_sq), impl.band_hit_sq);
+    // Points on the floor or in the height band prove that the ray crossed the band up to them.
+    // Points above the band, e.g. on the ceiling, don't.
+    impl.band_observed_sq =
+        (impl.row_depth > 0.0f && impl.row_height <= max_height)
+            .select(impl.row_range_sq.max(impl.band_observed_sq), impl.band_observed_sq);
+
+    if ((row + 1) % kBeamBandRows == 0 || row + 1 == rows) {
+      const uint16_t* band_beams = impl.beam_index.data() + (row / kBeamBandRows) * cols;
+      for (int col = 0; col < cols; col++) {
+        const uint16_t beam = band_beams[col];
+        if (beam == kNoBeam) continue;
+        impl.beam_hit_sq[beam] = std::min(impl.beam_hit_sq[beam], impl.band_hit_sq[col]);
+        impl.beam_observed_sq[beam] =
+            std::max(impl.beam_observed_sq[beam], impl.band_observed_sq[col]);
+      }
+      impl.band_hit_sq.setConstant(infinity);
+      impl.band_observed_sq.setZero();
+    }
+  }
+
+  if (get_enable_flatscan()) {
+    auto flatscan = tx_flatscan().initProto();
+    auto angles = flatscan.initAngles(num_beams);
+    auto ranges = flatscan.initRanges(num_beams);
+    for (int beam = 0; beam < num_beams; beam++) {
+      float range;
+      if (impl.beam_hit_sq[beam] < infinity) {
+        // Hits closer than min_range fall below the invalid range threshold
+        range = std::min(std::sqrt(impl.beam_hit_sq[beam]), max_range);
+      } else if (impl.beam_observed_sq[beam] >= max_range * max_range) {
+        // The beam is clear up to the maximum range
+        range = max_range;
+      } else {
+        // Not observed far enough to be known clear, the beam is invalid
+        range = 0.0f;
+      }
+      angles.set(beam, impl.beam_angles[beam]);
+      ranges.set(beam, range);
+    }
+    flatscan.setInvalidRangeThreshold(min_range);
+    flatscan.setOutOfRangeThreshold(max_range);
+    tx_flatscan().publish(acqtime);
+  }
+
+  if (get_enable_obstacle_grid()) {
+    const int grid_rows = get_obstacle_grid_rows();
+    const int grid_cols = get_obstacle_grid_cols();
+    const double cell_size = get_obstacle_grid_cell_size();
+    Image1ub grid(grid_rows, grid_cols);
+    for (int grid_row = 0; grid_row < grid_rows; grid_row++) {
+      for (int grid_col = 0; grid_col < grid_cols; grid_col++) {
+        grid(grid_row, grid_col) = kGridUnknown;
+      }
+    }
+
+    // Returns the grid cell containing a point in the robot frame, or false if outside the grid
+    auto to_cell = [&](double x, double y, int& grid_row, int& grid_col) {
+      grid_row = static_cast<int>(std::floor(x / cell_size));
+      grid_col = static_cast<int>(std::floor(y / cell_size)) + grid_cols / 2;
+      return grid_row >= 0 && grid_row < grid_rows && grid_col >= 0 && grid_col < grid_cols;
+    };
+
+    // Trace every beam from the camera. Cells are only free between flatscan_min_range and the
+    // closest obstacle or the farthest observed point of the beam. Beams without observed points
+    // and the blind zone in front of the camera stay unknown, unless an obstacle was seen there.
+    const double origin_x = robot_T_depth_camera.translation.x();
+    const double origin_y = robot_T_depth_camera.translation.y();
+    const double step = 0.5 * cell_size;
+    for (int beam = 0; beam < num_beams; beam++) {
+      if (impl.beam_observed_sq[beam] <= 0.0f) continue;
+      const double hit = std::sqrt(impl.beam_hit_sq[beam]);
+      const double free_end =
+          std::min({hit, std::sqrt(static_cast<double>(impl.beam_observed_sq[beam])),
+                    static_cast<double>(max_range)});
+      const double dx = std::cos(impl.beam_angles[beam]);
+      const double dy = std::sin(impl.beam_angles[beam]);
+      int grid_row, grid_col;
+      for (double distance = min_range; distance < free_end; distance += step) {
+        if (to_cell(origin_x + distance * dx, origin_y + distance * dy, grid_row, grid_col) &&
+            grid(grid_row, grid_col) != kGridOccupied) {
+          grid(grid_row, grid_col) = kGridFree;
+        }
+      }
+      if (hit < max_range &&
+          to_cell(origin_x + hit * dx, origin_y + hit * dy, grid_row, grid_col)) {
+        grid(grid_row, grid_col) = kGridOccupied;
+      }
+    }
+
+    ToProto(std::move(grid), tx_obstacle_grid().initProto(), tx_obstacle_grid().buffers());
+    tx_obstacle_grid().publish(acqtime);
+  }
+}
+
 // At the codelet startup, applies the default camera settings to RS ISP
 void AE400Camera::initializeDeviceConfig(const rs2::device& dev) {
   // NOTE: this method is called before the pipeline is started, and not all
@@ -19,9 +19,11 @@ Modify this driver to support LIPS AE400 Stereo Camera
 
 #include "engine/alice/alice_codelet.hpp"
 #include "engine/core/math/types.hpp"
+#include "engine/gems/geometry/pinhole.hpp"
 #include "librealsense2/rs.hpp"
 #include "librealsense2/lips_ae400_imu.h"
 #include "messages/camera.capnp.h"
+#include "messages/flatscan.capnp.h"
 #include "messages/imu.capnp.h"
 
 namespace isaac {
@@ -50,6 +52,11 @@ namespace lips {
 // Valid framerate for the color image are 60, 30, 15, 6 FPS. Valid framerate for the depth image
 // are 90, 60, 30, 15, 6 FPS. The camera can also produce images at 1920x1080, however this is currently
 // not supported as color and depth are set to the same resolution.
+//
+// For obstacle avoidance the codelet can additionally reduce the Z16 depth image to a virtual 2D
+// range scan and a small local obstacle grid in the robot frame. Both are computed directly from
+// the raw depth frame at the full depth rate, so the dense depth image does not need to be
+// published or converted to a point cloud. The camera mount pose is read from the pose tree.
 class AE400Camera : public alice::Codelet {
  public:
   AE400Camera();
@@ -77,10 +84,27 @@ class AE400Camera : public alice::Codelet {
   ISAAC_PROTO_TX(CameraIntrinsicsProto, depth_intrinsics);
   // Sensor data from the built-in IMU device (Accelerometer and Gyroscope)
   ISAAC_PROTO_TX(ImuProto, imu_raw);
+  // Virtual 2D range scan derived from the depth image, in the depth_scan frame. Beams with an
+  // obstacle closer than flatscan_min_range have an invalid range, as well as beams without an
+  // obstacle that were not observed up to flatscan_max_range.
+  ISAAC_PROTO_TX(FlatscanProto, flatscan);
+  // Local obstacle grid (Image1ub) derived from the depth image, in the robot frame. Row index
+  // grows along the robot X axis starting at the robot origin, column index grows along the robot
+  // Y axis with the robot in the middle column. Cells are 0 for free, 255 for occupied and 128 for
+  // unknown.
+  ISAAC_PROTO_TX(ImageProto, obstacle_grid);
 
   // IR stereo camera extrinsics (the right_T_left IR camera transformation).
   // The camera extrinsics doesn't change with time.
   ISAAC_POSE3(left_ir_camera, right_ir_camera);
+  // Mount pose of the camera the depth image is expressed in: the left IR camera, or the color
+  // camera if align_to_color is enabled. Required for the flatscan and obstacle grid outputs.
+  // The depth_camera frame is the optical frame: X right, Y down and Z forward along the optical
+  // axis, unlike the robot frame which has X forward, Y left and Z up.
+  ISAAC_POSE3(robot, depth_camera);
+  // Origin of the flatscan: the depth camera position projected onto the robot ground plane, with
+  // the same orientation as the robot frame.
+  ISAAC_POSE3(robot, depth_scan);
   // The vertical resolution for both color and depth images.
   ISAAC_PARAM(int, rows, 360);
   // The horizontal resolution for both color and depth images.
@@ -114,7 +138,8 @@ class AE400Camera : public alice::Codelet {
   // Enable acquisition and publication of the color frames.
   // This setting can't be changed at runtime.
   ISAAC_PARAM(bool, enable_color, true);
-  // Enable depth map computation and publication. This setting can't be changed at runtime.
+  // Enable depth map computation and publication. The depth stream is also acquired if the
+  // flatscan or the obstacle grid is enabled. This setting can't be changed at runtime.
   ISAAC_PARAM(bool, enable_depth, true);
   // Enable the depth laser projector to improve the depth image accuracy.
   // Disabling it helps the visual odometry tracker by removing the dot pattern
@@ -134,6 +159,28 @@ class AE400Camera : public alice::Codelet {
   // the Realsense camera can be found printed on the device. If specified, this parameter will take
   // precedence over the dev_index parameter above.
   ISAAC_PARAM(std::string, serial_number, "")
+  // Enable computation and publication of the flatscan derived from the depth image. It needs
+  // the robot_T_depth_camera pose.
+  ISAAC_PARAM(bool, enable_flatscan, false);
+  // Enable computation and publication of the obstacle grid derived from the depth image. It needs
+  // the robot_T_depth_camera pose.
+  ISAAC_PARAM(bool, enable_obstacle_grid, false);
+  // Depth points between these heights (in meters, along the robot Z axis) are considered
+  // obstacles. Everything else, e.g. the floor or an overhanging table top, is ignored.
+  ISAAC_PARAM(double, obstacle_min_height, 0.05);
+  ISAAC_PARAM(double, obstacle_max_height, 1.5);
+  // Obstacles closer than this horizontal distance (in meters) to the camera are in the blind zone
+  // of the flatscan and reported as invalid ranges.
+  ISAAC_PARAM(double, flatscan_min_range, 0.2);
+  // Beams without an obstacle up to this horizontal distance (in meters) are reported as out of
+  // range.
+  ISAAC_PARAM(double, flatscan_max_range, 6.0);
+  // Size of an obstacle grid cell, in meters
+  ISAAC_PARAM(double, obstacle_grid_cell_size, 0.05);
+  // Number of obstacle grid cells along the robot X axis
+  ISAAC_PARAM(int, obstacle_grid_rows, 100);
+  // Number of obstacle grid cells along the robot Y axis
+  ISAAC_PARAM(int, obstacle_grid_cols, 100);
 
  private:
   struct TimeStampInfo;
@@ -150,6 +197,15 @@ class AE400Camera : public alice::Codelet {
   // The expectation is that the RS ISP uses the same variable time epoch for all frame timestamps.
   int64_t getAdjustedTimeStamp(int64_t camera_timestamp, TimeStampInfo& tsInfo);
 
+  // Reduces the Z16 depth frame to the flatscan and obstacle grid outputs and publishes them
+  void publishObstacles(const rs2::depth_frame& depth_frame, int64_t acqtime);
+
+  // Computes the per-column and per-row ray tables for the given depth intrinsics and mount pose
+  void updateRayTables(const geometry::PinholeD& pinhole, const Pose3d& robot_T_depth_camera);
+
+  // Checks the flatscan and obstacle grid parameters, returns false if they are inconsistent
+  bool checkObstacleParameters();
+
   std::unique_ptr<Impl> impl_;
 };
 